@@ -0,0 +1,345 @@
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "soundObject.hpp"
+
+// Headless batch tool: traces every listener/source pair of a query list against
+// one scene and writes one JSON object per pair (JSON lines), no window or audio device needed.
+//
+// usage: batch <scene.txt> <pairs.txt> <out.jsonl> [-r rays] [-j threads] [-s sampleRate] [-p packetSize]
+// (-p 0 traces every ray on its own with scatterRay)
+//
+// scene.txt, one command per line ('#' starts a comment):
+//   rect   <width> <height> <centerX> <centerY>
+//   line   <x1> <y1> <x2> <y2>
+//   absorb <a1000> <a2000> <a4000> <a8000> <a16000>
+//   scale  <scale>
+//   depth  <max bounces>
+//   cutoff <audibility threshold in dB relative to the direct path>
+//   maxtime <seconds a ray may travel>
+//   radius <source receive radius>
+// pairs.txt, one query per line:
+//   <listenerX> <listenerY> <sourceX> <sourceY>
+
+struct Scene
+{
+  Boundry boundry;
+  float absorbFactor[5] = {0.95f, 0.95f, 0.95f, 0.95f, 0.95f};
+  float scale = 10.0f;
+  int depth = 64;
+  float cutoff = -60.0f;
+  float maxTime = 1.0f;
+  float receiveRadius = 0.5f;
+};
+
+struct Query
+{
+  Vec2f listener;
+  Vec2f source;
+};
+
+struct Options
+{
+  int rays = 500;
+  int threads = 0;
+  int sampleRate = 44100;
+  int packetSize = 16;
+};
+
+bool loadScene(const char *fileName, Scene &scene)
+{
+  std::ifstream file(fileName);
+  if (!file)
+  {
+    std::cerr << "Scene not found: " << fileName << std::endl;
+    return false;
+  }
+  std::string text;
+  int lineNumber = 0;
+  while (std::getline(file, text))
+  {
+    lineNumber++;
+    size_t comment = text.find('#');
+    if (comment != std::string::npos)
+      text.erase(comment);
+    std::istringstream in(text);
+    std::string cmd;
+    if (!(in >> cmd))
+      continue;
+    bool ok = true;
+    if (cmd == "rect")
+    {
+      float w, h, cx, cy;
+      ok = bool(in >> w >> h >> cx >> cy);
+      if (ok)
+      {
+        Vec2f c(cx, cy);
+        Vec2f points[4] = {c - Vec2f(w / 2, h / 2),
+                           c - Vec2f(w / 2, -h / 2),
+                           c - Vec2f(-w / 2, -h / 2),
+                           c - Vec2f(-w / 2, h / 2)};
+        for (int i = 0; i < 4; i++)
+          scene.boundry.addLine(points[i], points[(i + 1) % 4]);
+      }
+    }
+    else if (cmd == "line")
+    {
+      float x1, y1, x2, y2;
+      ok = bool(in >> x1 >> y1 >> x2 >> y2);
+      if (ok)
+        scene.boundry.addLine(Vec2f(x1, y1), Vec2f(x2, y2));
+    }
+    else if (cmd == "absorb")
+    {
+      for (int i = 0; i < 5 && ok; i++)
+        ok = bool(in >> scene.absorbFactor[i]);
+    }
+    else if (cmd == "scale")
+      ok = bool(in >> scene.scale);
+    else if (cmd == "depth")
+      ok = bool(in >> scene.depth);
+    else if (cmd == "cutoff")
+      ok = bool(in >> scene.cutoff);
+    else if (cmd == "maxtime")
+      ok = bool(in >> scene.maxTime);
+    else if (cmd == "radius")
+      ok = bool(in >> scene.receiveRadius);
+    else
+      ok = false;
+    if (!ok)
+    {
+      std::cerr << fileName << ":" << lineNumber << ": cannot parse \"" << text << "\"" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool loadQueries(const char *fileName, std::vector<Query> &queries)
+{
+  std::ifstream file(fileName);
+  if (!file)
+  {
+    std::cerr << "Pairs not found: " << fileName << std::endl;
+    return false;
+  }
+  std::string text;
+  int lineNumber = 0;
+  while (std::getline(file, text))
+  {
+    lineNumber++;
+    size_t comment = text.find('#');
+    if (comment != std::string::npos)
+      text.erase(comment);
+    std::istringstream in(text);
+    float lx, ly, sx, sy;
+    if (!(in >> lx))
+      continue;
+    if (!(in >> ly >> sx >> sy))
+    {
+      std::cerr << fileName << ":" << lineNumber << ": cannot parse \"" << text << "\"" << std::endl;
+      return false;
+    }
+    queries.push_back({Vec2f(lx, ly), Vec2f(sx, sy)});
+  }
+  return true;
+}
+
+// JSON has no inf or nan, e.g. a listener sitting on the source has an
+// infinite gain; those are written as null
+void writeFloat(std::string &out, float v)
+{
+  if (!std::isfinite(v))
+  {
+    out += "null";
+    return;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.9g", v);
+  out += buf;
+}
+
+void writeVec(std::string &out, Vec2f v)
+{
+  out += '[';
+  writeFloat(out, v.x);
+  out += ',';
+  writeFloat(out, v.y);
+  out += ']';
+}
+
+// Traces one pair and formats it as a single JSON line. The band-wise impulse
+// response is written sparsely: one tap per arrival sample, summed over the
+// paths landing on that sample, with one amplitude per band.
+std::string runQuery(Scene &scene, const Query &query, int index, const Options &options)
+{
+  Source source;
+  source.pos = query.source;
+  source.receiveRadius = scene.receiveRadius;
+  Listener listener;
+  listener.pos = query.listener;
+  listener.depth = scene.depth;
+  listener.cutoff = scene.cutoff;
+  listener.maxTime = scene.maxTime;
+  listener.scale = scene.scale;
+  for (int i = 0; i < 5; i++)
+    listener.absorbFactor[i] = scene.absorbFactor[i];
+  if (options.packetSize > 0)
+    listener.scatterRayPacket(options.rays, options.packetSize, scene.boundry, source);
+  else
+    listener.scatterRay(options.rays, scene.boundry, source);
+
+  std::map<long long, std::vector<float>> taps;
+  std::string out;
+  out += "{\"query\":" + std::to_string(index) + ",\"listener\":";
+  writeVec(out, query.listener);
+  out += ",\"source\":";
+  writeVec(out, query.source);
+  out += ",\"paths\":[";
+  bool first = true;
+  for (auto &path : listener.paths)
+  {
+    if (!first)
+      out += ',';
+    first = false;
+    out += "{\"lines\":[";
+    for (int i = 0; i < path.indexArray.size(); i++)
+    {
+      if (i)
+        out += ',';
+      out += std::to_string(path.indexArray[i]);
+    }
+    out += "],\"hitPoints\":[";
+    for (int i = 0; i < path.hitPoint.size(); i++)
+    {
+      if (i)
+        out += ',';
+      writeVec(out, path.hitPoint[i]);
+    }
+    out += "],\"dir\":";
+    writeVec(out, path.dir);
+    out += ",\"dist\":";
+    writeFloat(out, path.dist);
+    out += ",\"delay\":";
+    writeFloat(out, path.delay);
+    out += ",\"absorb\":";
+    writeFloat(out, path.absorb);
+    out += ",\"bands\":[";
+    for (int i = 0; i < 5; i++)
+    {
+      if (i)
+        out += ',';
+      writeFloat(out, path.reflectAbsorb[i]);
+    }
+    out += "]}";
+
+    std::vector<float> &tap = taps[(long long)(options.sampleRate * path.delay)];
+    tap.resize(5, 0.0f);
+    for (int i = 0; i < 5; i++)
+      tap[i] += path.absorb * path.reflectAbsorb[i];
+  }
+  out += "],\"ir\":{\"sampleRate\":" + std::to_string(options.sampleRate) + ",\"taps\":[";
+  first = true;
+  for (auto &tap : taps)
+  {
+    if (!first)
+      out += ',';
+    first = false;
+    out += '[' + std::to_string(tap.first);
+    for (int i = 0; i < 5; i++)
+    {
+      out += ',';
+      writeFloat(out, tap.second[i]);
+    }
+    out += ']';
+  }
+  out += "]}}\n";
+  return out;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 4)
+  {
+    std::cerr << "usage: " << argv[0] << " <scene.txt> <pairs.txt> <out.jsonl> [-r rays] [-j threads] [-s sampleRate] [-p packetSize]" << std::endl;
+    return 1;
+  }
+  Options options;
+  for (int i = 4; i < argc; i++)
+  {
+    if (i + 1 >= argc)
+    {
+      std::cerr << "missing value for " << argv[i] << std::endl;
+      return 1;
+    }
+    int value = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "-r"))
+      options.rays = value;
+    else if (!strcmp(argv[i], "-j"))
+      options.threads = value;
+    else if (!strcmp(argv[i], "-s"))
+      options.sampleRate = value;
+    else if (!strcmp(argv[i], "-p"))
+      options.packetSize = value;
+    else
+    {
+      std::cerr << "unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+    i++;
+  }
+  if (options.rays <= 0 || options.sampleRate <= 0)
+  {
+    std::cerr << "rays and sampleRate must be positive" << std::endl;
+    return 1;
+  }
+
+  Scene scene;
+  std::vector<Query> queries;
+  if (!loadScene(argv[1], scene) || !loadQueries(argv[2], queries))
+    return 1;
+
+  std::ofstream out(argv[3], std::ios::binary);
+  if (!out)
+  {
+    std::cerr << "Cannot write: " << argv[3] << std::endl;
+    return 1;
+  }
+
+  int threads = options.threads > 0 ? options.threads : (int)std::thread::hardware_concurrency();
+  if (threads < 1)
+    threads = 1;
+  if (threads > (int)queries.size())
+    threads = (int)queries.size();
+
+  // the scene is only read while tracing, so every worker shares it
+  std::vector<std::string> results(queries.size());
+  std::atomic<int> next(0);
+  auto work = [&]()
+  {
+    for (int i = next++; i < (int)queries.size(); i = next++)
+      results[i] = runQuery(scene, queries[i], i, options);
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; i++)
+    workers.emplace_back(work);
+  work();
+  for (auto &worker : workers)
+    worker.join();
+
+  for (auto &result : results)
+    out << result;
+  std::cout << "lines: " << scene.boundry.lines.size() << std::endl;
+  std::cout << "queries: " << queries.size() << std::endl;
+  return 0;
+}
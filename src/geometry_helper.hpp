@@ -14,4 +14,27 @@ Vec2f reflectPoint(Vec2f startPoint, Vec2f endPoint, Vec2f needRefectPoint) {
     Vec2f verticalPoint = startPoint + verticalValue * lineDir;
     Vec2f v2 = verticalPoint - needRefectPoint;
     return needRefectPoint + 2.0f * v2;
-}
\ No newline at end of file
+}
+
+float pointSegmentDistance(Vec2f point, Vec2f start, Vec2f end) {
+    Vec2f lineDir = end - start;
+    float length = lineDir.magSqr();
+    float a = length > 0 ? (point - start).dot(lineDir) / length : 0;
+    a = a < 0 ? 0 : (a > 1 ? 1 : a);
+    return (start + a * lineDir - point).mag();
+}
+
+float segmentDistance(Vec2f s1, Vec2f e1, Vec2f s2, Vec2f e2) {
+    Vec2f d1 = e1 - s1;
+    Vec2f d2 = e2 - s2;
+    float c1 = d1.x * (s2.y - s1.y) - d1.y * (s2.x - s1.x);
+    float c2 = d1.x * (e2.y - s1.y) - d1.y * (e2.x - s1.x);
+    float c3 = d2.x * (s1.y - s2.y) - d2.y * (s1.x - s2.x);
+    float c4 = d2.x * (e1.y - s2.y) - d2.y * (e1.x - s2.x);
+    if (((c1 < 0 && c2 > 0) || (c1 > 0 && c2 < 0)) && ((c3 < 0 && c4 > 0) || (c3 > 0 && c4 < 0)))
+        return 0;
+    float d = pointSegmentDistance(s1, s2, e2);
+    d = fminf(d, pointSegmentDistance(e1, s2, e2));
+    d = fminf(d, pointSegmentDistance(s2, s1, e1));
+    return fminf(d, pointSegmentDistance(e2, s1, e1));
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -13,6 +14,7 @@
 #include "al/io/al_Imgui.hpp"
 #include "al/math/al_Ray.hpp"
 #include "soundObject.hpp"
+#include "workerPool.hpp"
 #include "Gamma/Filter.h"
 
 // reference: http://gamma.cs.unc.edu/GSOUND/gsound_aes41st.pdf, http://gamma.cs.unc.edu/SOUND09/
@@ -24,12 +26,15 @@ struct MyApp : App
   Boundry boundry;
   Source source;
   Listener listener;
-  std::vector<Mesh> rays;
+  Mesh pathMesh{Mesh::LINES};
+  unsigned int pathMeshVersion = 0;
   Vec2f listenerDir;
   Vec2f lineDir;
   float lineLength;
+  int sceneLines;
   float absorbFactor = 0.95f;
   float scale = 10.0f;
+  int packetSize = 16;
 
   std::mutex mLock;
   bool enableAddLine = false;
@@ -40,17 +45,35 @@ struct MyApp : App
 
   float earDiff;
 
+  // per-path mixing runs on audioWorkers threads, the audio thread included
+  WorkerPool audioPool;
+  int audioWorkers = 4;
+  std::vector<const Path *> mixPaths;
+  std::vector<float> submix;
+  int mixFrames;
+  int mixChannels;
+  int mixSecond;
+  int mixTasks;
+  long long int mixPlayerFrame;
+
   void onCreate() override
   {
     addScene(boundry);
+    sceneLines = boundry.lines.size();
     nav().pos(Vec3f(0, 0, 25));
     Ray2d r(Vec2f(0, 0), Vec2f(1, 0));
 
     source.init("./data/pno-cs.wav");
     source.pos = Vec2f(0, 0);
     listener.pos = Vec2f(1, -1);
-    listener.scatterRay(500, boundry, source);
+    listener.scatterRayPacket(500, packetSize, boundry, source);
     Domain::master().spu(audioIO().framesPerSecond());
+    int cores = std::thread::hardware_concurrency();
+    if (cores > 0 && audioWorkers > cores)
+      audioWorkers = cores;
+    audioPool.start(audioWorkers);
+    mixPaths.reserve(500);
+    submix.resize(audioWorkers * audioIO().framesPerBuffer() * 2);
     for (int j = 0; j < 5; j++) {
       for (int i = 0; i < 500; i++) {
         bq[j][i].type(gam::BAND_PASS);
@@ -60,21 +83,6 @@ struct MyApp : App
         //bq[j][i].res(0.5f / oneOverQ);
       }
     }
-    for (auto p : listener.paths)
-    {
-      Mesh m;
-      m.primitive(Mesh::LINE_STRIP);
-      m.vertex(listener.pos);
-      m.color(RGB(1, 0, 0));
-      for (auto point : p.hitPoint)
-      {
-        m.vertex(Vec3f(point, 0.0f));
-        m.color(RGB(0.5f, 0.5f, 1));
-      }
-      m.vertex(source.pos);
-      m.color(RGB(0, 1, 0));
-      rays.push_back(m);
-    }
     navControl().disable();
   }
 
@@ -136,6 +144,7 @@ struct MyApp : App
 
   void onAnimate(double dt) override
   {
+    audioPool.report();
     listener.pos += listenerDir;
     nav().pos(Vec3f(0, 0, 12));
     nav().faceToward(Vec3f(0, 0, 0));
@@ -143,24 +152,45 @@ struct MyApp : App
     {
       mLock.lock();
       listener.paths.clear();
-      listener.scatterRay(500, boundry, source);
+      listener.scatterRayPacket(500, packetSize, boundry, source);
       mLock.unlock();
     }
-    rays.clear();
-    for (auto p : listener.paths)
+    updatePathMesh();
+  }
+
+  // All paths as one line list: listener in red, hit points in blue, source in
+  // green. Rebuilt only when the listener published new paths.
+  void updatePathMesh()
+  {
+    if (pathMeshVersion == listener.pathsVersion)
+      return;
+    pathMeshVersion = listener.pathsVersion;
+    int vertexCount = 0;
+    for (auto &p : listener.paths)
+    {
+      vertexCount += (p.hitPoint.size() + 1) * 2;
+    }
+    pathMesh.reset();
+    pathMesh.primitive(Mesh::LINES);
+    pathMesh.vertices().reserve(vertexCount);
+    pathMesh.colors().reserve(vertexCount);
+    for (auto &p : listener.paths)
     {
-      Mesh m;
-      m.primitive(Mesh::LINE_STRIP);
-      m.vertex(listener.pos);
-      m.color(RGB(1, 0, 0));
+      Vec2f last = listener.pos;
+      RGB lastColor(1, 0, 0);
       for (auto point : p.hitPoint)
       {
-        m.vertex(Vec3f(point, 0.0f));
-        m.color(RGB(0.5f, 0.5f, 1));
+        pathMesh.vertex(Vec3f(last, 0.0f));
+        pathMesh.color(lastColor);
+        pathMesh.vertex(Vec3f(point, 0.0f));
+        pathMesh.color(RGB(0.5f, 0.5f, 1));
+        last = point;
+        lastColor = RGB(0.5f, 0.5f, 1);
       }
-      m.vertex(source.pos);
-      m.color(RGB(0, 1, 0));
-      rays.push_back(m);
+      pathMesh.vertex(Vec3f(last, 0.0f));
+      pathMesh.color(lastColor);
+      pathMesh.vertex(Vec3f(source.pos, 0.0f));
+      pathMesh.color(RGB(0, 1, 0));
     }
   }
 
@@ -172,14 +202,10 @@ struct MyApp : App
     g.pushMatrix();
     g.draw(boundry.mesh);
     g.popMatrix();
-    for (auto &ray : rays)
-    {
-      g.polygonLine();
-      g.pushMatrix();
-      g.meshColor();
-      g.draw(ray);
-      g.popMatrix();
-    }
+    g.pushMatrix();
+    g.meshColor();
+    g.draw(pathMesh);
+    g.popMatrix();
     g.pushMatrix();
     g.color(RGB(0, 1, 0));
     g.draw(source.circle);
@@ -188,6 +214,39 @@ struct MyApp : App
     drawImGUI(g);
   }
 
+  // Mixes one group of paths into the stereo submix of the worker running it.
+  // Every path owns its biquads, so groups never share filter state.
+  static void mixTask(void *context, int task, int worker)
+  {
+    MyApp &app = *(MyApp *)context;
+    int pathCount = app.mixPaths.size();
+    int first = task * pathCount / app.mixTasks;
+    int last = (task + 1) * pathCount / app.mixTasks;
+    float *out = &app.submix[worker * app.mixFrames * 2];
+    const float *data = app.source.playerTS.soundFile.data.data();
+    for (int indexBQ = first; indexBQ < last; indexBQ++)
+    {
+      const Path &path = *app.mixPaths[indexBQ];
+      long long int offset = app.source.playerTS.soundFile.sampleRate * path.delay;
+      float cosTheta = path.dir.dot(app.listener.leftDirection);
+      float gainL = path.absorb * (cosTheta > 0 ? app.earDiff + 0.5 * cosTheta : app.earDiff);
+      float gainR = path.absorb * (cosTheta > 0 ? app.earDiff : app.earDiff + 0.5 * -cosTheta);
+      for (int frame = 0; frame < app.mixFrames; frame++)
+      {
+        long long int index = app.mixPlayerFrame + frame * app.mixChannels - offset;
+        if (index < 0)
+          continue;
+        float s = (data[index] + data[index + app.mixSecond]) * 0.5f;
+        float totalS = 0;
+        for (int i = 0; i < 5; i++) {
+          totalS += app.bq[i][indexBQ](s) * path.reflectAbsorb[i];
+        }
+        out[frame * 2] += totalS * gainL;
+        out[frame * 2 + 1] += totalS * gainR;
+      }
+    }
+  }
+
   void onSound(AudioIOData &io) override
   {
 
@@ -199,49 +258,46 @@ struct MyApp : App
       source.buffer.resize(bufferLength);
     }
     int second = (channels < 2) ? 0 : 1;
-    while (io())
+    if (enableReflect)
     {
-      int frame = (int)io.frame();
-      int idx = frame * channels;
-      if (enableReflect)
+      if ((int)submix.size() < audioPool.workerCount() * frames * 2)
       {
-        float ds = 0;
-        mLock.lock();
+        submix.resize(audioPool.workerCount() * frames * 2);
+      }
+      std::fill(submix.begin(), submix.begin() + audioPool.workerCount() * frames * 2, 0.0f);
+      mixFrames = frames;
+      mixChannels = channels;
+      mixSecond = second;
+      mixPlayerFrame = source.playerTS.player.frame;
+      mLock.lock();
+      mixPaths.clear();
+      for (auto &path : listener.paths)
+      {
+        if (mixPaths.size() == 500)
+          break;
+        mixPaths.push_back(&path);
+      }
+      mixTasks = audioPool.workerCount() * 4;
+      audioPool.run(mixTask, this, mixTasks, frames / io.framesPerSecond());
+      mLock.unlock();
+      while (io())
+      {
+        int frame = (int)io.frame();
         io.out(0) = 0;
         io.out(1) = 0;
-        int indexBQ = 0;
-        for (auto path : listener.paths)
+        for (int w = 0; w < audioPool.workerCount(); w++)
         {
-          long long int index = source.playerTS.player.frame + idx;
-          long long int offset = source.playerTS.soundFile.sampleRate * path.delay;
-          index -= offset;
-          if (index < 0)
-            continue;
-          float s = (source.playerTS.soundFile.data[index] + source.playerTS.soundFile.data[index + second]) * 0.5f;
-          //ds += source.playerTS.soundFile.data[index] * path.absorb * path.reflectAbsorb;
-          Vec2f dir = path.dir;
-          float cosTheta = dir.dot(listener.leftDirection);
-          if (cosTheta > 0) {
-            float totalS = 0;
-            for (int i = 0; i < 5; i++) {
-              totalS += bq[i][indexBQ](s) * path.reflectAbsorb[i];
-            }
-            io.out(0) += totalS * path.absorb * (earDiff + 0.5 * cosTheta);
-            io.out(1) += totalS * path.absorb * (earDiff);  
-          } else {
-            float totalS = 0;
-            for (int i = 0; i < 5; i++) {
-              totalS += bq[i][indexBQ](s) * path.reflectAbsorb[i];
-            }
-            io.out(0) += totalS * path.absorb * earDiff;
-            io.out(1) += totalS * path.absorb * (earDiff + 0.5 * -cosTheta);
-          }
-          indexBQ++;
+          io.out(0) += submix[(w * frames + frame) * 2];
+          io.out(1) += submix[(w * frames + frame) * 2 + 1];
         }
-        mLock.unlock();
       }
-      else
+    }
+    else
+    {
+      while (io())
       {
+        int frame = (int)io.frame();
+        int idx = frame * channels;
         io.out(0) = source.playerTS.soundFile.data[source.playerTS.player.frame + idx];
         io.out(1) = source.playerTS.soundFile.data[source.playerTS.player.frame + idx + second];
       }
@@ -254,7 +310,13 @@ struct MyApp : App
     imguiInit();
   }
 
-  void onExit() override { imguiShutdown(); }
+  void onExit() override
+  {
+    // the audio callback must be done with the pool before it goes away
+    audioIO().stop();
+    audioPool.stop();
+    imguiShutdown();
+  }
 
   void drawImGUI(Graphics &g)
   {
@@ -306,31 +368,25 @@ struct MyApp : App
     anythingChange += fabs(_absorb4 - listener.absorbFactor[4]) < alpha ? 0 : 1;
     listener.absorbFactor[4] = _absorb4;
 
+    static float _cutoff = -60.0f;
+    ImGui::SliderFloat("cutoff dB", &_cutoff, -120.0f, -20.0f);
+    anythingChange += fabs(_cutoff - listener.cutoff) < alpha ? 0 : 1;
+    listener.cutoff = _cutoff;
+
+    static float _maxTime = 1.0f;
+    ImGui::SliderFloat("max time", &_maxTime, 0.1f, 5.0f);
+    anythingChange += fabs(_maxTime - listener.maxTime) < alpha ? 0 : 1;
+    listener.maxTime = _maxTime;
+
     if (anythingChange) {
       nav().pos(Vec3f(0, 0, 12));
       nav().faceToward(Vec3f(0, 0, 0));
       {
         mLock.lock();
         listener.paths.clear();
-        listener.scatterRay(500, boundry, source);
+        listener.scatterRayPacket(500, packetSize, boundry, source);
         mLock.unlock();
       }
-      rays.clear();
-      for (auto p : listener.paths)
-      {
-        Mesh m;
-        m.primitive(Mesh::LINE_STRIP);
-        m.vertex(listener.pos);
-        m.color(RGB(1, 0, 0));
-        for (auto point : p.hitPoint)
-        {
-          m.vertex(Vec3f(point, 0.0f));
-          m.color(RGB(0.5f, 0.5f, 1));
-        }
-        m.vertex(source.pos);
-        m.color(RGB(0, 1, 0));
-        rays.push_back(m);
-      }
     }
 
     static bool _addLine = false;
@@ -346,6 +402,15 @@ struct MyApp : App
     ImGui::SliderFloat("Line Length", &_lineLength, 0.0f, 5.0f);
     lineLength = _lineLength;
 
+    if (ImGui::Button("Remove Last Line") && boundry.lines.size() > sceneLines) {
+      int index = boundry.lines.size() - 1;
+      mLock.lock();
+      Line old = boundry.lines[index];
+      boundry.removeLine(index);
+      listener.lineRemoved(index, old, boundry, source);
+      mLock.unlock();
+    }
+
     ImGui::End();
     imguiEndFrame();
     imguiDraw();
@@ -388,32 +453,15 @@ struct MyApp : App
       //std::cout<<"1"<<std::endl;
       Vec2f start = hitPoint - lineDir.normalize() * lineLength / 2;
       Vec2f end = hitPoint + lineDir.normalize() * lineLength / 2;
-      boundry.addLine(start, end);
-      boundry.Line2Mesh(Line(start, end));
       nav().pos(Vec3f(0, 0, 12));
       nav().faceToward(Vec3f(0, 0, 0));
       {
         mLock.lock();
-        listener.paths.clear();
-        listener.scatterRay(500, boundry, source);
+        boundry.addLine(start, end);
+        boundry.Line2Mesh(Line(start, end));
+        listener.lineAdded(boundry, source);
         mLock.unlock();
       }
-      rays.clear();
-      for (auto p : listener.paths)
-      {
-        Mesh m;
-        m.primitive(Mesh::LINE_STRIP);
-        m.vertex(listener.pos);
-        m.color(RGB(1, 0, 0));
-        for (auto point : p.hitPoint)
-        {
-          m.vertex(Vec3f(point, 0.0f));
-          m.color(RGB(0.5f, 0.5f, 1));
-        }
-        m.vertex(source.pos);
-        m.color(RGB(0, 1, 0));
-        rays.push_back(m);
-      }
     }
     return true;
   }
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <set>
 #include "al/graphics/al_Mesh.hpp"
+#include "al/graphics/al_Shapes.hpp"
 #include "al/sound/al_SoundFile.hpp"
 #include "Gamma/Delay.h"
 #include "geometry_helper.hpp"
@@ -83,6 +86,106 @@ struct Ray2d
     }
 };
 
+// A bundle of rays in angular order that are traced together. Every lane lies on
+// a ray from a common apex (the listener, or its mirror image after the lanes
+// reflected off the same line), so a line outside the cone spanned by the lanes
+// can be skipped for the whole packet with a single test.
+struct RayPacket
+{
+    static const int maxSize = 16;
+    int count = 0;
+    Vec2f apex;
+    int ray[maxSize];
+    float oriX[maxSize], oriY[maxSize];
+    float dirX[maxSize], dirY[maxSize];
+    bool cone = false;
+    Vec2f right, left;
+
+    void add(int index, Vec2f o, Vec2f d)
+    {
+        ray[count] = index;
+        oriX[count] = o.x;
+        oriY[count] = o.y;
+        dirX[count] = d.x;
+        dirY[count] = d.y;
+        count++;
+    }
+
+    // whether a lane starting at o in direction d is on a ray from the apex
+    bool fromApex(Vec2f o, Vec2f d) const
+    {
+        Vec2f v = o - apex;
+        return fabs(d.x * v.y - d.y * v.x) < 1e-3f && d.dot(v) > -1e-3f;
+    }
+
+    // finds the outermost lanes; lanes are only culled together if every lane
+    // is within 60 degrees of lane 0, which keeps the cone narrower than a half
+    // plane
+    void bound()
+    {
+        cone = false;
+        if (count < 2)
+            return;
+        Vec2f ref(dirX[0], dirY[0]);
+        float minCross = 0, maxCross = 0;
+        right = left = ref;
+        for (int i = 1; i < count; i++)
+        {
+            Vec2f d(dirX[i], dirY[i]);
+            if (ref.dot(d) < 0.5f)
+                return;
+            float cross = ref.x * d.y - ref.y * d.x;
+            if (cross < minCross) { minCross = cross; right = d; }
+            if (cross > maxCross) { maxCross = cross; left = d; }
+        }
+        cone = true;
+    }
+
+    // conservative: false only if no lane can hit the line
+    bool mayHit(const Line &line) const
+    {
+        if (!cone)
+            return true;
+        Vec2f s = line.start - apex;
+        Vec2f e = line.end - apex;
+        const float margin = 2e-3f;
+        if (right.x * s.y - right.y * s.x < -margin && right.x * e.y - right.y * e.x < -margin)
+            return false;
+        if (s.x * left.y - s.y * left.x < -margin && e.x * left.y - e.y * left.x < -margin)
+            return false;
+        return true;
+    }
+
+    // same math as Ray2d::lineDetect, one lane after another
+    void lineDetect(const Line &line, float *t) const
+    {
+        float lineX = line.start.x - line.end.x;
+        float lineY = line.start.y - line.end.y;
+        // branch free so the lanes can be vectorized
+        for (int i = 0; i < count; i++)
+        {
+            float bigY = dirY[i] * lineX - dirX[i] * lineY;
+            float bigX = dirX[i] * (line.end.y - oriY[i]) - dirY[i] * (line.end.x - oriX[i]);
+            bool parallel = fabsf(bigY) < alpha;
+            float a = bigX / (parallel ? 1.0f : bigY);
+            float hitX = line.start.x * a + (1 - a) * line.end.x;
+            float hitY = line.start.y * a + (1 - a) * line.end.y;
+            float hit = (hitX - oriX[i]) * dirX[i] + (hitY - oriY[i]) * dirY[i];
+            t[i] = (parallel || a < 0 || a > 1) ? -1.0f : hit;
+        }
+    }
+
+    // same math as Ray2d::circleDetect, one lane after another
+    void circleDetect(Vec2f pos, float radius, float *t) const
+    {
+        for (int i = 0; i < count; i++)
+        {
+            Ray2d r(Vec2f(oriX[i], oriY[i]), Vec2f(dirX[i], dirY[i]));
+            t[i] = r.circleDetect(pos, radius);
+        }
+    }
+};
+
 struct Source
 {
     Vec2f pos;
@@ -119,6 +222,8 @@ struct Path
     float scale = 10.0f;
     float absorbFactor[5] = {0.95f, 0.95f, 0.95f, 0.95f, 0.95f};
     Vec2f dir;
+    float travel = 0; // length of the legs traced so far
+    float weight = 1; // russian roulette survival weight, only used to decide when to stop
    //Delay<float, ipl::Trunc> delayFiliter;
 
     void calculateImageSource(std::vector<Line>& lines) {
@@ -183,6 +288,16 @@ struct Path
     }
 };
 
+// Where one scattered ray went: its path, and where its last leg stopped. Kept
+// so that a scene edit only retraces the rays whose legs the edit touches.
+struct RayTrace
+{
+    Path path;
+    bool found = false;
+    Vec2f end;
+    int endLine = -1; // line the last leg stops at, -1 at the source or in open space
+};
+
 class Boundry
 {
 public:
@@ -215,6 +330,24 @@ public:
         currentIndex++;
     }
 
+    void removeLine(int index)
+    {
+        lines.erase(lines.begin() + index);
+        for (int i = index; i < lines.size(); i++)
+            lines[i].index = i;
+        currentIndex--;
+        mesh.reset();
+        line2Meshs();
+    }
+
+    void moveLine(int index, Vec2f start, Vec2f end)
+    {
+        lines[index].start = start;
+        lines[index].end = end;
+        mesh.reset();
+        line2Meshs();
+    }
+
     void Line2Mesh(Line line) {
         mesh.vertex(Vec3f(line.start, 0.0f));
         mesh.vertex(Vec3f(line.end, 0.0f));
@@ -234,11 +367,73 @@ public:
 struct Listener
 {
     Vec2f pos;
-    int depth = 10;
+    int depth = 64; // hard cap, rays normally stop on energy or time first
+    float cutoff = -60.0f; // audibility threshold in dB relative to the direct path
+    float maxTime = 1.0f; // seconds of travel before a ray stops
     std::set<Path> paths;
+    unsigned int pathsVersion = 0; // bumped whenever paths is published anew
     Vec2f leftDirection = Vec2f(-1, 0);
     float absorbFactor[5] = {0.95f, 0.95f, 0.95f, 0.95f, 0.95f};
     float scale = 10.0f;
+    std::vector<RayTrace> traces; // empty after scatterRay, which keeps no traces
+    int rayCount = 0;
+    int rayPacketSize = 16;
+    static constexpr float farDistance = 1e4f;
+
+    void finishPath(Path &p, Boundry &boundry, Source &source)
+    {
+        p.start = pos;
+        p.end = source.pos;
+        for (int i = 0; i < 5; i++) {
+            p.absorbFactor[i] = absorbFactor[i];
+        }
+        p.scale = scale;
+        p.calculateImageSource(boundry.lines);
+    }
+
+    // Called when a ray hits a line at hitPoint: whether it should reflect and
+    // keep going. The ray's strongest band, with spreading loss, is compared to
+    // the direct path; below cutoff it survives russian roulette with a
+    // probability proportional to its level. The survival weight only feeds
+    // later stop decisions: the gain of a found path is exact from its image
+    // source and is not scaled.
+    bool keepTracing(Path &p, Vec2f hitPoint, Source &source)
+    {
+        Vec2f last = p.hitPoint.empty() ? pos : p.hitPoint.back();
+        p.travel += (hitPoint - last).mag();
+        if (p.indexArray.size() >= depth)
+            return false;
+        if (p.travel * scale / 340.0f > maxTime)
+            return false;
+        float energy = 0;
+        for (int i = 0; i < 5; i++)
+            energy = fmaxf(energy, powf(absorbFactor[i], p.indexArray.size() + 1));
+        float direct = fmaxf((source.pos - pos).mag(), source.receiveRadius);
+        float level = energy * sqrtf(direct / fmaxf(p.travel, alpha)) * p.weight;
+        float threshold = powf(10.0f, cutoff / 20.0f);
+        if (level >= threshold)
+            return true;
+        float survive = level / threshold;
+        if (roulette(hitPoint, p.indexArray.size()) >= survive)
+            return false;
+        p.weight /= survive;
+        return true;
+    }
+
+    // uniform in [0, 1), seeded by the hit so every tracer draws the same number
+    static float roulette(Vec2f hitPoint, int bounce)
+    {
+        uint32_t x, y;
+        memcpy(&x, &hitPoint.x, sizeof(x));
+        memcpy(&y, &hitPoint.y, sizeof(y));
+        uint32_t h = x * 0x9E3779B1u ^ y * 0x85EBCA77u ^ (uint32_t)bounce * 0xC2B2AE3Du;
+        h ^= h >> 15;
+        h *= 0x2C1B3C6Du;
+        h ^= h >> 12;
+        h *= 0x297A2D39u;
+        h ^= h >> 15;
+        return (h >> 8) * (1.0f / 16777216.0f);
+    }
 
     void reflectRay(float t, Ray2d ray, Line *_line, Boundry &boundry, Source &source, Path &p)
     {
@@ -265,19 +460,13 @@ struct Listener
         float temp = r.circleDetect(source.pos, source.receiveRadius);
         if (temp > alpha && (temp < t || t < alpha))
         {
-            p.start = pos;
-            p.end = source.pos;
-            for (int i = 0; i < 5; i++) {
-                p.absorbFactor[i] = absorbFactor[i];
-            }
-            p.scale = scale;
-            p.calculateImageSource(boundry.lines);
+            finishPath(p, boundry, source);
             paths.insert(p);
         }
         else if (temp < alpha && t > alpha)
         {
             p.start = pos;
-            if (p.indexArray.size() < depth)
+            if (keepTracing(p, r(t), source))
             {
                 p.indexArray.push_back(hitLine->index);
                 p.hitPoint.push_back(r(t));
@@ -288,6 +477,8 @@ struct Listener
 
     void scatterRay(int num, Boundry &boundry, Source &source)
     {
+        rayCount = num;
+        traces.clear();
         float offset = M_2PI / (float)num;
         float start = 0; //(float)random() / RAND_MAX;
         for (int i = 0; i < num; i++)
@@ -313,25 +504,259 @@ struct Listener
 
             if (temp > alpha && (temp < t || t < alpha))
             {
-                p.start = pos;
-                p.end = source.pos;
-                for (int i = 0; i < 5; i++) {
-                    p.absorbFactor[i] = absorbFactor[i];
-                }
-                p.scale = scale;
-                p.calculateImageSource(boundry.lines);
+                finishPath(p, boundry, source);
                 paths.insert(p);
                 // std::cout<< r(temp) << std::endl;
             }
             else if (t > alpha)
             {
                 p.start = pos;
+                if (!keepTracing(p, r(t), source))
+                    continue;
                 p.indexArray.push_back(hitLine->index);
                 p.hitPoint.push_back(r(t));
                 reflectRay(t, r, hitLine, boundry, source, p);
                 // std::cout<< temp << r(t) << std::endl;
             }
         }
+        pathsVersion++;
+    }
+
+    // Traces one packet for one bounce, then splits it by hit line so that every
+    // sub-packet keeps reflecting off the same line and stays coherent.
+    void tracePacket(RayPacket &packet, Boundry &boundry, Source &source)
+    {
+        packet.bound();
+        float t[RayPacket::maxSize];
+        float temp[RayPacket::maxSize];
+        int hitLine[RayPacket::maxSize];
+        for (int i = 0; i < packet.count; i++)
+        {
+            t[i] = -1;
+            hitLine[i] = -1;
+        }
+        for (int l = 0; l < boundry.lines.size(); l++)
+        {
+            Line &line = boundry.lines[l];
+            if (!packet.mayHit(line))
+                continue;
+            packet.lineDetect(line, temp);
+            for (int i = 0; i < packet.count; i++)
+            {
+                bool closer = temp[i] > alpha && (temp[i] < t[i] || t[i] < alpha);
+                t[i] = closer ? temp[i] : t[i];
+                hitLine[i] = closer ? l : hitLine[i];
+            }
+        }
+        packet.circleDetect(source.pos, source.receiveRadius, temp);
+
+        // lanes that keep reflecting, in angular order
+        int next[RayPacket::maxSize];
+        int nextCount = 0;
+        for (int i = 0; i < packet.count; i++)
+        {
+            RayTrace &trace = traces[packet.ray[i]];
+            Path &p = trace.path;
+            Ray2d r(Vec2f(packet.oriX[i], packet.oriY[i]), Vec2f(packet.dirX[i], packet.dirY[i]));
+            bool first = p.indexArray.empty();
+            trace.end = r(t[i] > alpha ? t[i] : farDistance);
+            trace.endLine = t[i] > alpha ? boundry.lines[hitLine[i]].index : -1;
+            if (temp[i] > alpha && (temp[i] < t[i] || t[i] < alpha))
+            {
+                finishPath(p, boundry, source);
+                trace.found = true;
+                trace.end = r(temp[i]);
+                trace.endLine = -1;
+            }
+            else if ((first || temp[i] < alpha) && t[i] > alpha)
+            {
+                p.start = pos;
+                if (keepTracing(p, r(t[i]), source))
+                    next[nextCount++] = i;
+            }
+        }
+
+        bool taken[RayPacket::maxSize] = {};
+        for (int n = 0; n < nextCount; n++)
+        {
+            if (taken[n])
+                continue;
+            Line &line = boundry.lines[hitLine[next[n]]];
+            RayPacket sub;
+            sub.apex = reflectPoint(line.start, line.end, packet.apex);
+            for (int m = n; m < nextCount; m++)
+            {
+                int i = next[m];
+                if (taken[m] || hitLine[i] != hitLine[next[n]])
+                    continue;
+                taken[m] = 1;
+                Ray2d r(Vec2f(packet.oriX[i], packet.oriY[i]), Vec2f(packet.dirX[i], packet.dirY[i]));
+                Vec2f hitPoint = r(t[i]);
+                Path &p = traces[packet.ray[i]].path;
+                p.indexArray.push_back(line.index);
+                p.hitPoint.push_back(hitPoint);
+                // same reflection as reflectRay
+                Vec2f lineDir = (hitPoint - line.start).normalize();
+                float cosTheta = r.dir.dot(lineDir);
+                Vec2f vertical = cosTheta * lineDir - r.dir;
+                Vec2f newRayDir = cosTheta * lineDir + vertical;
+                if (sub.fromApex(hitPoint, newRayDir))
+                {
+                    sub.add(packet.ray[i], hitPoint, newRayDir);
+                }
+                else
+                {
+                    // reflection near an end point of the line, trace it on its own
+                    RayPacket single;
+                    single.apex = hitPoint;
+                    single.add(packet.ray[i], hitPoint, newRayDir);
+                    tracePacket(single, boundry, source);
+                }
+            }
+            if (sub.count)
+                tracePacket(sub, boundry, source);
+        }
+    }
+
+    // Same paths as scatterRay, but neighbouring rays are traced in packets of
+    // packetSize (up to RayPacket::maxSize) lanes. Every ray is kept in traces
+    // for lineAdded, lineMoved and lineRemoved.
+    void scatterRayPacket(int num, int packetSize, Boundry &boundry, Source &source)
+    {
+        if (packetSize < 1) packetSize = 1;
+        if (packetSize > RayPacket::maxSize) packetSize = RayPacket::maxSize;
+        rayPacketSize = packetSize;
+        rayCount = num;
+        traces.assign(num, RayTrace());
+        std::vector<char> dirty(num, 1);
+        retrace(dirty, boundry, source);
+    }
+
+    // The scene got line boundry.lines.back(): only rays with a leg crossing it
+    // can reflect off it or be blocked by it.
+    void lineAdded(Boundry &boundry, Source &source)
+    {
+        if (traceAgain(boundry, source))
+            return;
+        std::vector<char> dirty(traces.size(), 0);
+        markCrossing(boundry.lines.back(), dirty);
+        retrace(dirty, boundry, source);
+    }
+
+    // Line index was at old and now is boundry.lines[index].
+    void lineMoved(int index, Line old, Boundry &boundry, Source &source)
+    {
+        if (traceAgain(boundry, source))
+            return;
+        std::vector<char> dirty(traces.size(), 0);
+        markHitting(index, dirty);
+        markCrossing(old, dirty);
+        markCrossing(boundry.lines[index], dirty);
+        retrace(dirty, boundry, source);
+    }
+
+    // Line index was removed from the scene (and was old); the lines after it
+    // moved down by one.
+    void lineRemoved(int index, Line old, Boundry &boundry, Source &source)
+    {
+        if (traceAgain(boundry, source))
+            return;
+        std::vector<char> dirty(traces.size(), 0);
+        markHitting(index, dirty);
+        markCrossing(old, dirty);
+        for (int i = 0; i < traces.size(); i++)
+        {
+            if (dirty[i])
+                continue;
+            for (auto &lineIndex : traces[i].path.indexArray)
+            {
+                if (lineIndex > index)
+                    lineIndex--;
+            }
+            if (traces[i].endLine > index)
+                traces[i].endLine--;
+        }
+        retrace(dirty, boundry, source);
+    }
+
+    // Without a trace for every ray (last scatter was scatterRay) nothing can be
+    // retraced selectively, so all rays are traced again with packets.
+    bool traceAgain(Boundry &boundry, Source &source)
+    {
+        if (traces.size() == rayCount)
+            return false;
+        scatterRayPacket(rayCount, rayPacketSize, boundry, source);
+        return true;
+    }
+
+    void markHitting(int index, std::vector<char> &dirty)
+    {
+        for (int i = 0; i < traces.size(); i++)
+        {
+            RayTrace &trace = traces[i];
+            if (trace.endLine == index)
+                dirty[i] = 1;
+            for (auto lineIndex : trace.path.indexArray)
+            {
+                if (lineIndex == index)
+                    dirty[i] = 1;
+            }
+        }
+    }
+
+    void markCrossing(const Line &line, std::vector<char> &dirty)
+    {
+        for (int i = 0; i < traces.size(); i++)
+        {
+            if (dirty[i])
+                continue;
+            RayTrace &trace = traces[i];
+            Vec2f legStart = pos;
+            for (int j = 0; j <= trace.path.hitPoint.size() && !dirty[i]; j++)
+            {
+                Vec2f legEnd = j < trace.path.hitPoint.size() ? trace.path.hitPoint[j] : trace.end;
+                if (segmentDistance(legStart, legEnd, line.start, line.end) < 1e-3f)
+                    dirty[i] = 1;
+                legStart = legEnd;
+            }
+        }
+    }
+
+    // Traces the dirty rays again, neighbours still share packets, and
+    // publishes the paths of all rays in ray order.
+    void retrace(std::vector<char> &dirty, Boundry &boundry, Source &source)
+    {
+        int num = traces.size();
+        float offset = M_2PI / (float)num;
+        float start = 0;
+        for (int i = 0; i < num;)
+        {
+            if (!dirty[i])
+            {
+                i++;
+                continue;
+            }
+            RayPacket packet;
+            packet.apex = pos;
+            for (; i < num && dirty[i] && packet.count < rayPacketSize; i++)
+            {
+                RayTrace &trace = traces[i];
+                trace = RayTrace();
+                trace.path.indexArray.reserve(depth);
+                trace.path.hitPoint.reserve(depth);
+                float theta = start + i * offset;
+                packet.add(i, pos, Vec2f(cosf(theta), sinf(theta)));
+            }
+            tracePacket(packet, boundry, source);
+        }
+        // insert in ray order so duplicates resolve exactly like scatterRay
+        paths.clear();
+        for (auto &trace : traces)
+        {
+            if (trace.found)
+                paths.insert(trace.path);
+        }
+        pathsVersion++;
     }
 };
 
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Worker threads the audio callback can hand work to. Everything is allocated in
+// start(); run() only touches atomics, so it is safe to call from the audio
+// thread. Idle workers spin on a generation counter instead of sleeping on a
+// condition variable, which keeps the wake up latency far below a block.
+class WorkerPool
+{
+public:
+    typedef void (*Job)(void *context, int task, int worker);
+
+    ~WorkerPool() { stop(); }
+
+    // threads counts the calling thread, which always works as worker 0
+    void start(int threads)
+    {
+        stop();
+        workers = threads < 1 ? 1 : threads;
+        slots.reset(new Slot[workers]);
+        generation.store(0);
+        running.store(true);
+        int cores = std::thread::hardware_concurrency();
+        for (int w = 1; w < workers; w++)
+        {
+            pool.emplace_back(&WorkerPool::loop, this, w);
+#ifdef __linux__
+            if (cores > 1)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(w % cores, &set);
+                pthread_setaffinity_np(pool.back().native_handle(), sizeof(set), &set);
+            }
+#endif
+        }
+    }
+
+    void stop()
+    {
+        running.store(false);
+        for (auto &thread : pool)
+            thread.join();
+        pool.clear();
+        // without threads run() must not wait for anyone but the caller
+        workers = 1;
+    }
+
+    int workerCount() { return workers; }
+
+    // Runs job(context, task, worker) for every task in [0, tasks) and returns
+    // once all of them are done. A worker still busy deadline seconds after the
+    // call is counted as late, see report().
+    void run(Job job, void *context, int tasks, double deadline)
+    {
+        currentJob = job;
+        currentContext = context;
+        taskCount = tasks;
+        nextTask.store(0, std::memory_order_relaxed);
+        pending.store(workers - 1, std::memory_order_relaxed);
+        long long begin = now();
+        generation.fetch_add(1, std::memory_order_release);
+
+        work(0);
+        int spins = 0;
+        while (pending.load(std::memory_order_acquire) > 0)
+            relax(spins);
+
+        long long limit = begin + (long long)(deadline * 1e9);
+        for (int w = 0; w < workers; w++)
+        {
+            long long finished = slots[w].finished.load(std::memory_order_relaxed);
+            if (finished > limit)
+            {
+                slots[w].late.fetch_add(1, std::memory_order_relaxed);
+                if (finished - begin > slots[w].worst.load(std::memory_order_relaxed))
+                    slots[w].worst.store(finished - begin, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Watchdog: prints the workers that missed a deadline since the last call.
+    // Not real-time safe, call it from the graphics thread.
+    void report()
+    {
+        for (int w = 0; w < workers; w++)
+        {
+            long long late = slots[w].late.load(std::memory_order_relaxed);
+            if (late == slots[w].reported)
+                continue;
+            std::cout << "audio worker " << w << " late in " << late - slots[w].reported
+                      << " blocks, worst " << slots[w].worst.exchange(0) * 1e-6 << " ms" << std::endl;
+            slots[w].reported = late;
+        }
+    }
+
+private:
+    // one cache line per worker, so workers never write to a shared line
+    struct alignas(64) Slot
+    {
+        std::atomic<long long> finished{0};
+        std::atomic<long long> late{0};
+        std::atomic<long long> worst{0};
+        long long reported = 0;
+    };
+
+    int workers = 1;
+    std::unique_ptr<Slot[]> slots{new Slot[1]};
+    std::vector<std::thread> pool;
+    std::atomic<bool> running{false};
+    alignas(64) std::atomic<unsigned> generation{0};
+    alignas(64) std::atomic<int> nextTask{0};
+    alignas(64) std::atomic<int> pending{0};
+    Job currentJob = nullptr;
+    void *currentContext = nullptr;
+    int taskCount = 0;
+
+    static long long now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static void relax(int &spins)
+    {
+        if (spins++ < 4096)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#endif
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    void work(int worker)
+    {
+        for (int task = nextTask.fetch_add(1); task < taskCount; task = nextTask.fetch_add(1))
+            currentJob(currentContext, task, worker);
+        slots[worker].finished.store(now(), std::memory_order_relaxed);
+    }
+
+    void loop(int worker)
+    {
+        unsigned seen = 0;
+        while (true)
+        {
+            int spins = 0;
+            unsigned current;
+            while ((current = generation.load(std::memory_order_acquire)) == seen)
+            {
+                if (!running.load(std::memory_order_relaxed))
+                    return;
+                relax(spins);
+            }
+            seen = current;
+            work(worker);
+            pending.fetch_sub(1, std::memory_order_release);
+        }
+    }
+};